@@ -1,44 +1,74 @@
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <cstdint>
+#include <cstdlib>
+#include <functional>
 #include <iostream>
+#include <memory>
+#include <queue>
+#include <random>
 #include <string>
+#include <unordered_map>
 #include <vector>
+#if defined(__unix__) || defined(__APPLE__)
+#include <atomic>
+#include <chrono>
+#include <new>
+#include <thread>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
 
 using std::cout; using std::endl; using std::cin;
 using std::string;
 using std::vector;
 
 class PersonVisitor;
+class GenealogyHistory;
 
+// spouses and a woman's children are linked only by the GenealogyHistory
+// recording the marriages and births, so the tree is always its current version
 class Person { // component
 public:
 	Person(string firstName,
-		Person *spouse,
 		Person *father,
 		Person *mother) :
-		firstName_(firstName), spouse_(spouse),
+		id_(nextId_++), firstName_(firstName), spouse_(nullptr),
 		father_(father), mother_(mother) {}
+	unsigned getId() { return id_; }
 	string getFirstName() { return firstName_; }
 	Person *getSpouse() { return spouse_; }
-	void setSpouse(Person *spouse) { spouse_ = spouse; }
 	Person *getFather() { return father_; }
+	Person *getMother() { return mother_; }
 
 	virtual void accept(PersonVisitor *) = 0;
 	virtual ~Person() {}
 private:
+	friend class GenealogyHistory;
+	void setSpouse(Person *spouse) { spouse_ = spouse; }
+
+	static unsigned nextId_;	// ids are dense, in order of construction
+	unsigned id_;
 	string firstName_;
 	Person *spouse_;
 	Person *father_;
 	Person *mother_;
 };
 
+unsigned Person::nextId_ = 0;
+
 // man has a last name 
 class Man : public Person {
 public:
 	Man(string lastName,
 		string firstName,
-		Person *spouse,
 		Person *father, Person *mother) :
 		lastName_(lastName),
-		Person(firstName, spouse, father, mother) {}
+		Person(firstName, father, mother) {}
 	string getLastName() { return lastName_; }
 	void accept(PersonVisitor *visitor);
 private:
@@ -48,16 +78,15 @@ private:
 // woman has a list of children
 class Woman : public Person {
 public:
-	Woman(vector<Person *> children,
-		string firstName,
-		Person *spouse,
+	Woman(string firstName,
 		Person *father, Person *mother) :
-		children_(children),
-		Person(firstName, spouse, father, mother) {}
+		Person(firstName, father, mother) {}
 	const vector<Person *> &getChildren() { return children_; }
-	void setChildren(const vector<Person *> &children) { children_ = children; }
 	void accept(PersonVisitor *visitor);
 private:
+	friend class GenealogyHistory;
+	void addChild(Person *child) { children_.push_back(child); }
+
 	vector<Person *> children_;
 };
 
@@ -125,616 +154,1694 @@ private:
 	}
 };
 
+// helpers shared by the visitors below
+
+// a woman's last name comes from her father,
+// or from her spouse if her father is unknown
+string fullNameOf(Person *p) {
+	if (p == nullptr)
+		return "";
+	Man *man = dynamic_cast<Man *>(p);
+	if (man != nullptr)
+		return man->getFirstName() + " " + man->getLastName();
+	Person *namedBy = p->getFather() != nullptr ? p->getFather() : p->getSpouse();
+	if (namedBy == nullptr)
+		return "";
+	return p->getFirstName() + " " + static_cast<Man *>(namedBy)->getLastName();
+}
+
+// a man's children are looked up in his spouse's object
+const vector<Person *> &childrenOf(Person *p) {
+	static const vector<Person *> noChildren;
+	if (p == nullptr)
+		return noChildren;
+	Woman *woman = dynamic_cast<Woman *>(p);
+	if (woman == nullptr)
+		woman = dynamic_cast<Woman *>(p->getSpouse());
+	return woman != nullptr ? woman->getChildren() : noChildren;
+}
+
+// every person reachable from the roots through any family link,
+// indexed by person id
+class PersonDirectory {
+public:
+	explicit PersonDirectory(Person *root) : PersonDirectory(vector<Person *>{ root }) {}
+	explicit PersonDirectory(const vector<Person *> &roots);
+	Person *find(unsigned id) const { return id < byId_.size() ? byId_[id] : nullptr; }
+	const vector<Person *> &people() const { return byId_; }	// nullptr where an id is unused
+private:
+	vector<Person *> byId_;
+};
+
+PersonDirectory::PersonDirectory(const vector<Person *> &roots) {
+	vector<Person *> pending = roots;
+	while (!pending.empty()) {
+		Person *p = pending.back();
+		pending.pop_back();
+		if (p == nullptr)
+			continue;
+		if (p->getId() >= byId_.size())
+			byId_.resize(p->getId() + 1, nullptr);
+		if (byId_[p->getId()] != nullptr)
+			continue;
+		byId_[p->getId()] = p;
+		pending.push_back(p->getFather());
+		pending.push_back(p->getMother());
+		pending.push_back(p->getSpouse());
+		for (const auto &child : childrenOf(p))
+			pending.push_back(child);
+	}
+}
+
+// how two persons are related by blood, through their closest common ancestor
+struct Kinship {
+	bool related;
+	unsigned up;				// generations from the first person up to the ancestor
+	unsigned down;				// generations from the ancestor down to the second person
+	vector<Person *> path;		// first person, ..., ancestor, ..., second person
+	string relationship;		// what the second person is to the first
+};
+
+// parent links of everyone in a directory, laid out by person id.
+// a blood relationship is a path up from one person and down to the other,
+// so relate() searches upward from both ends until the searches meet
+class KinshipGraph {
+public:
+	explicit KinshipGraph(const PersonDirectory &directory);
+	Kinship relate(Person *first, Person *second) const;
+	static string relationshipName(unsigned up, unsigned down);
+private:
+	// one end of the bidirectional search; scratch space is kept
+	// between queries and only the entries a query touched are reset
+	struct SearchSide {
+		vector<uint64_t> visited;	// bitmap by person id
+		vector<int> via;			// the child a person was reached from
+		vector<unsigned> depth;
+		vector<unsigned> touched;
+		bool seen(unsigned id) const { return (visited[id >> 6] >> (id & 63)) & 1; }
+		void mark(unsigned id, int from, unsigned d) {
+			visited[id >> 6] |= uint64_t(1) << (id & 63);
+			via[id] = from;
+			depth[id] = d;
+			touched.push_back(id);
+		}
+		void reset() {
+			for (unsigned id : touched)
+				visited[id >> 6] = 0;
+			touched.clear();
+		}
+	};
+
+	const PersonDirectory &directory_;
+	vector<int> fathers_, mothers_;		// parent ids, -1 when unknown
+	mutable SearchSide sides_[2];
+};
+
+KinshipGraph::KinshipGraph(const PersonDirectory &directory) : directory_(directory) {
+	const size_t count = directory.people().size();
+	fathers_.assign(count, -1);
+	mothers_.assign(count, -1);
+	for (const auto &p : directory.people()) {
+		if (p == nullptr)
+			continue;
+		if (p->getFather() != nullptr)
+			fathers_[p->getId()] = static_cast<int>(p->getFather()->getId());
+		if (p->getMother() != nullptr)
+			mothers_[p->getId()] = static_cast<int>(p->getMother()->getId());
+	}
+	for (auto &side : sides_) {
+		side.visited.assign((count + 63) / 64, 0);
+		side.via.assign(count, -1);
+		side.depth.assign(count, 0);
+	}
+}
+
+// breadth first, one whole generation at a time, always extending the
+// side with the smaller frontier. an ancestor reached through several
+// lines (pedigree collapse) is expanded only once per side
+Kinship KinshipGraph::relate(Person *first, Person *second) const {
+	Kinship kinship{ false, 0, 0, {}, "" };
+	const unsigned ends[2] = { first->getId(), second->getId() };
+	if (directory_.find(ends[0]) != first || directory_.find(ends[1]) != second)
+		return kinship;
+
+	vector<unsigned> frontiers[2];
+	unsigned levels[2] = { 0, 0 };
+	unsigned best = ~0u;
+	int meeting = -1;
+	for (int s = 0; s < 2; ++s) {
+		sides_[s].mark(ends[s], -1, 0);
+		frontiers[s].push_back(ends[s]);
+	}
+	if (ends[0] == ends[1]) {
+		best = 0;
+		meeting = static_cast<int>(ends[0]);
+	}
+
+	vector<unsigned> next;
+	while (!frontiers[0].empty() || !frontiers[1].empty()) {
+		// a meeting not found yet needs a side that is still searching to
+		// reach a new ancestor, which may already be known to the other side
+		// at any depth; so it is at least one generation past that side's level
+		unsigned bound = ~0u;
+		for (int s = 0; s < 2; ++s)
+			if (!frontiers[s].empty())
+				bound = std::min(bound, levels[s] + 1);
+		if (best <= bound)
+			break;
+		const int s = frontiers[1].empty()
+			|| (!frontiers[0].empty() && frontiers[0].size() <= frontiers[1].size()) ? 0 : 1;
+		SearchSide &side = sides_[s];
+		const SearchSide &other = sides_[1 - s];
+		next.clear();
+		for (unsigned id : frontiers[s])
+			for (int parent : { fathers_[id], mothers_[id] }) {
+				if (parent < 0 || side.seen(parent))
+					continue;
+				side.mark(parent, static_cast<int>(id), levels[s] + 1);
+				next.push_back(parent);
+				if (other.seen(parent) && levels[s] + 1 + other.depth[parent] < best) {
+					best = levels[s] + 1 + other.depth[parent];
+					meeting = parent;
+				}
+			}
+		++levels[s];
+		frontiers[s].swap(next);
+	}
+
+	if (meeting >= 0) {
+		kinship.related = true;
+		kinship.up = sides_[0].depth[meeting];
+		kinship.down = sides_[1].depth[meeting];
+		for (int id = meeting; id >= 0; id = sides_[0].via[id])
+			kinship.path.insert(kinship.path.begin(), directory_.find(id));
+		for (int id = sides_[1].via[meeting]; id >= 0; id = sides_[1].via[id])
+			kinship.path.push_back(directory_.find(id));
+		kinship.relationship = relationshipName(kinship.up, kinship.down);
+	}
+	sides_[0].reset();
+	sides_[1].reset();
+	return kinship;
+}
+
+string KinshipGraph::relationshipName(unsigned up, unsigned down) {
+	auto greats = [](unsigned count) {
+		string prefix;
+		for (unsigned i = 0; i < count; ++i)
+			prefix += "great-";
+		return prefix;
+	};
+	if (up == 0 && down == 0)
+		return "same person";
+	if (down == 0)
+		return up == 1 ? "parent" : greats(up - 2) + "grandparent";
+	if (up == 0)
+		return down == 1 ? "child" : greats(down - 2) + "grandchild";
+	if (up == 1 && down == 1)
+		return "sibling";
+	if (down == 1)
+		return greats(up - 2) + "aunt or uncle";
+	if (up == 1)
+		return greats(down - 2) + "niece or nephew";
+
+	static const char *ordinals[] = { "first", "second", "third", "fourth", "fifth" };
+	const unsigned degree = std::min(up, down) - 1;
+	const unsigned removed = up > down ? up - down : down - up;
+	string name = degree <= 5 ? ordinals[degree - 1] : std::to_string(degree) + "th";
+	name += " cousin";
+	if (removed == 1)
+		name += " once removed";
+	else if (removed == 2)
+		name += " twice removed";
+	else if (removed > 2)
+		name += " " + std::to_string(removed) + " times removed";
+	return name;
+}
+
+// the family links of one person at one point in time that can change;
+// parents are fixed at birth and kept by the person
+struct PersonRecord {
+	Person *spouse;
+};
+
+// 32-way trie from person id to record. versions share every node
+// a change did not touch, so a new version costs one path of nodes.
+// the depth of a node tells its kind: leaves hold the records themselves
+struct VersionNode {};
+struct VersionInner : VersionNode {
+	std::array<std::shared_ptr<const VersionNode>, 32> children;
+};
+struct VersionLeaf : VersionNode {
+	uint32_t born;		// one bit per slot holding a record
+	std::array<PersonRecord, 32> records;
+};
+
+// the genealogy as it was from date on; persons without a record
+// had not been born yet. lookups cost the same in every version
+class GenealogyVersion {
+public:
+	GenealogyVersion() : date_(0), depth_(0) {}
+	long getDate() const { return date_; }
+	const PersonRecord *recordOf(Person *p) const;
+	GenealogyVersion with(Person *p, const PersonRecord &record, long date) const;
+private:
+	static std::shared_ptr<const VersionNode> assign(const std::shared_ptr<const VersionNode> &node,
+		unsigned depth, unsigned id, const PersonRecord &record);
+	long date_;
+	std::shared_ptr<const VersionNode> root_;
+	unsigned depth_;	// inner levels above the leaves
+};
+
+const PersonRecord *GenealogyVersion::recordOf(Person *p) const {
+	const unsigned id = p->getId();
+	if (depth_ < 6 && (id >> (5 * (depth_ + 1))) != 0)
+		return nullptr;
+	const VersionNode *node = root_.get();
+	for (unsigned level = depth_; node != nullptr && level > 0; --level)
+		node = static_cast<const VersionInner *>(node)->children[(id >> (5 * level)) & 31].get();
+	const VersionLeaf *leaf = static_cast<const VersionLeaf *>(node);
+	return leaf != nullptr && (leaf->born >> (id & 31)) & 1 ? &leaf->records[id & 31] : nullptr;
+}
+
+std::shared_ptr<const VersionNode> GenealogyVersion::assign(const std::shared_ptr<const VersionNode> &node,
+	unsigned depth, unsigned id, const PersonRecord &record) {
+	const unsigned slot = (id >> (5 * depth)) & 31;
+	if (depth == 0) {
+		auto leaf = node != nullptr ? std::make_shared<VersionLeaf>(static_cast<const VersionLeaf &>(*node))
+			: std::make_shared<VersionLeaf>();
+		leaf->born |= uint32_t(1) << slot;
+		leaf->records[slot] = record;
+		return leaf;
+	}
+	auto inner = node != nullptr ? std::make_shared<VersionInner>(static_cast<const VersionInner &>(*node))
+		: std::make_shared<VersionInner>();
+	inner->children[slot] = assign(inner->children[slot], depth - 1, id, record);
+	return inner;
+}
+
+// path copying: only the nodes from the root down to p's record are new
+GenealogyVersion GenealogyVersion::with(Person *p, const PersonRecord &record, long date) const {
+	GenealogyVersion next(*this);
+	next.date_ = date;
+	const unsigned id = p->getId();
+	while (next.depth_ < 6 && (id >> (5 * (next.depth_ + 1))) != 0) {
+		// grow a level; the old trie becomes the first subtree
+		auto grown = std::make_shared<VersionInner>();
+		grown->children[0] = next.root_;
+		next.root_ = grown;
+		++next.depth_;
+	}
+	next.root_ = assign(next.root_, next.depth_, id, record);
+	return next;
+}
+
+// dated versions of the genealogy. events must be recorded in date
+// order; the record functions return false for one that is not, for
+// a second birth of the same person and for a marriage of someone
+// already married. recorded events also link the persons themselves,
+// so they always show the latest version
+class GenealogyHistory {
+public:
+	bool recordBirth(Person *child, long date);
+	bool recordMarriage(Person *first, Person *second, long date);
+	bool recordDivorce(Person *first, Person *second, long date);
+	const GenealogyVersion *asOf(long date) const;
+	const GenealogyVersion *current() const { return versions_.empty() ? nullptr : &versions_.back(); }
+private:
+	void commit(const GenealogyVersion &version);
+	vector<GenealogyVersion> versions_;		// ascending dates, one per date
+};
+
+void GenealogyHistory::commit(const GenealogyVersion &version) {
+	if (!versions_.empty() && versions_.back().getDate() == version.getDate())
+		versions_.back() = version;
+	else
+		versions_.push_back(version);
+}
+
+bool GenealogyHistory::recordBirth(Person *child, long date) {
+	if (!versions_.empty() && (date < versions_.back().getDate() || versions_.back().recordOf(child) != nullptr))
+		return false;
+	const GenealogyVersion previous = versions_.empty() ? GenealogyVersion() : versions_.back();
+	commit(previous.with(child, PersonRecord{ nullptr }, date));
+	Woman *mother = dynamic_cast<Woman *>(child->getMother());
+	if (mother != nullptr)
+		mother->addChild(child);
+	return true;
+}
+
+bool GenealogyHistory::recordMarriage(Person *first, Person *second, long date) {
+	if (versions_.empty() || date < versions_.back().getDate())
+		return false;
+	const PersonRecord *firstRecord = versions_.back().recordOf(first);
+	const PersonRecord *secondRecord = versions_.back().recordOf(second);
+	if (firstRecord == nullptr || secondRecord == nullptr
+		|| firstRecord->spouse != nullptr || secondRecord->spouse != nullptr)
+		return false;
+	PersonRecord firstUpdated(*firstRecord), secondUpdated(*secondRecord);
+	firstUpdated.spouse = second;
+	secondUpdated.spouse = first;
+	commit(versions_.back().with(first, firstUpdated, date).with(second, secondUpdated, date));
+	first->setSpouse(second);
+	second->setSpouse(first);
+	return true;
+}
+
+bool GenealogyHistory::recordDivorce(Person *first, Person *second, long date) {
+	if (versions_.empty() || date < versions_.back().getDate())
+		return false;
+	const PersonRecord *firstRecord = versions_.back().recordOf(first);
+	const PersonRecord *secondRecord = versions_.back().recordOf(second);
+	if (firstRecord == nullptr || secondRecord == nullptr || firstRecord->spouse != second)
+		return false;
+	PersonRecord firstUpdated(*firstRecord), secondUpdated(*secondRecord);
+	firstUpdated.spouse = nullptr;
+	secondUpdated.spouse = nullptr;
+	commit(versions_.back().with(first, firstUpdated, date).with(second, secondUpdated, date));
+	first->setSpouse(nullptr);
+	second->setSpouse(nullptr);
+	return true;
+}
+
+// the latest version dated on or before date, nullptr before the first event
+const GenealogyVersion *GenealogyHistory::asOf(long date) const {
+	auto after = std::upper_bound(versions_.begin(), versions_.end(), date,
+		[](long d, const GenealogyVersion &version) { return d < version.getDate(); });
+	return after == versions_.begin() ? nullptr : &*(after - 1);
+}
+
+// the links marriage rules look at, as person ids (-1 when unknown)
+struct KinshipRecord {
+	int32_t father, mother, spouse;
+};
+
+// where rules look persons up: the tree in this process, or a shard
+// fetching relatives kept by other shards. fetch answers false for
+// persons it does not know, including those not born yet
+class KinshipRecords {
+public:
+	virtual bool fetch(int32_t id, KinshipRecord &record) = 0;
+	virtual ~KinshipRecords() {}
+};
+
+// the tree in this process, optionally as it was in a version;
+// parents never change, spouses are read from the version
+class TreeRecords : public KinshipRecords {
+public:
+	TreeRecords(const PersonDirectory &directory, const GenealogyVersion *version = nullptr) :
+		directory_(directory), version_(version) {}
+	bool fetch(int32_t id, KinshipRecord &record);
+private:
+	const PersonDirectory &directory_;
+	const GenealogyVersion *version_;
+};
+
+bool TreeRecords::fetch(int32_t id, KinshipRecord &record) {
+	Person *p = id >= 0 ? directory_.find(static_cast<unsigned>(id)) : nullptr;
+	if (p == nullptr)
+		return false;
+	Person *spouse = p->getSpouse();
+	if (version_ != nullptr) {
+		const PersonRecord *versioned = version_->recordOf(p);
+		if (versioned == nullptr)
+			return false;
+		spouse = versioned->spouse;
+	}
+	auto idOf = [](Person *relative) { return relative != nullptr ? static_cast<int32_t>(relative->getId()) : -1; };
+	record = KinshipRecord{ idOf(p->getFather()), idOf(p->getMother()), idOf(spouse) };
+	return true;
+}
+
+// a marriage rule forbids one relationship between the candidates.
+// the check answers true when the pair passes; cost and the
+// expected rejection rate are estimates the planner starts from.
+// byBlood marks rules that forbid a blood relationship
+struct MarriageRule {
+	typedef std::function<bool(KinshipRecords &, int32_t candidate, int32_t other)> Check;
+	MarriageRule(string relationship, Check check,
+		double cost, double expectedRejectionRate, bool byBlood = false) :
+		relationship(relationship), check(check),
+		cost(cost), expectedRejectionRate(expectedRejectionRate), byBlood(byBlood),
+		evaluations(0), rejections(0) {}
+
+	// observed rejection rate, smoothed toward the estimate
+	// until enough evaluations have been seen
+	double rejectionRate() const {
+		const double priorWeight = 10.0;
+		return (rejections + expectedRejectionRate * priorWeight) / (evaluations + priorWeight);
+	}
+	// rules that reject often and cheaply should run first
+	double rank() const { return rejectionRate() / cost; }
+
+	string relationship;
+	Check check;
+	double cost;
+	double expectedRejectionRate;
+	bool byBlood;
+	unsigned evaluations;
+	unsigned rejections;
+};
+
+// the ancestors exactly generations above id; id itself for 0
+vector<int32_t> ancestorsAt(KinshipRecords &records, int32_t id, unsigned generations) {
+	vector<int32_t> current = { id };
+	for (unsigned generation = 0; generation < generations && !current.empty(); ++generation) {
+		vector<int32_t> parents;
+		KinshipRecord record;
+		for (int32_t person : current)
+			if (records.fetch(person, record))
+				for (int32_t parent : { record.father, record.mother })
+					if (parent >= 0 && std::find(parents.begin(), parents.end(), parent) == parents.end())
+						parents.push_back(parent);
+		current.swap(parents);
+	}
+	return current;
+}
+
+// whether some ancestor is up generations above the candidate and down above the other
+bool shareAncestorAt(KinshipRecords &records, int32_t candidate, int32_t other, unsigned up, unsigned down) {
+	const vector<int32_t> above = ancestorsAt(records, candidate, up);
+	for (int32_t ancestor : ancestorsAt(records, other, down))
+		if (std::find(above.begin(), above.end(), ancestor) != above.end())
+			return true;
+	return false;
+}
+
+// the rules of the README. both candidates must be known (and born)
+// and unmarried, and must not share an ancestor at a forbidden distance;
+// costs are rough counts of records each check fetches, rejection
+// rates are guesses the planner corrects at runtime
+vector<MarriageRule> standardMarriageRules() {
+	auto blood = [](unsigned up, unsigned down) {
+		return [up, down](KinshipRecords &records, int32_t candidate, int32_t other) {
+			return !shareAncestorAt(records, candidate, other, up, down);
+		};
+	};
+	return {
+		MarriageRule("same person", [](KinshipRecords &, int32_t candidate, int32_t other) {
+			return candidate != other;
+		}, 0.5, 0.01),
+		MarriageRule("already married", [](KinshipRecords &records, int32_t candidate, int32_t other) {
+			KinshipRecord first, second;
+			return records.fetch(candidate, first) && records.fetch(other, second)
+				&& first.spouse < 0 && second.spouse < 0;
+		}, 2, 0.50),
+		MarriageRule("parent", blood(1, 0), 2, 0.05, true),
+		MarriageRule("child", blood(0, 1), 2, 0.05, true),
+		MarriageRule("sibling", blood(1, 1), 4, 0.05, true),
+		MarriageRule("aunt or uncle", blood(2, 1), 8, 0.05, true),
+		MarriageRule("niece or nephew", blood(1, 2), 8, 0.05, true),
+		MarriageRule("cousin", blood(2, 2), 14, 0.05, true),
+	};
+}
+
+// orders the rules by rank and runs them until the first rejection,
+// re-planning after every pair from the statistics gathered so far
+class RulePlanner {
+public:
+	RulePlanner() : lastRejection_(-1) {}
+	void addRule(const MarriageRule &rule);
+	bool admits(KinshipRecords &records, int32_t candidate, int32_t other);
+	const MarriageRule *lastRejection() const { return lastRejection_ >= 0 ? &rules_[lastRejection_] : nullptr; }
+private:
+	void replan();
+	vector<MarriageRule> rules_;
+	vector<size_t> plan_;		// indices into rules_, best rank first
+	int lastRejection_;			// index into rules_, -1 when the last pair passed
+};
+
+void RulePlanner::addRule(const MarriageRule &rule) {
+	rules_.push_back(rule);
+	plan_.push_back(rules_.size() - 1);
+	replan();
+}
+
+bool RulePlanner::admits(KinshipRecords &records, int32_t candidate, int32_t other) {
+	lastRejection_ = -1;
+	for (size_t index : plan_) {
+		MarriageRule &rule = rules_[index];
+		++rule.evaluations;
+		if (!rule.check(records, candidate, other)) {
+			++rule.rejections;
+			lastRejection_ = static_cast<int>(index);
+			break;
+		}
+	}
+	replan();
+	return lastRejection_ < 0;
+}
+
+void RulePlanner::replan() {
+	std::stable_sort(plan_.begin(), plan_.end(), [this](size_t a, size_t b) {
+		return rules_[a].rank() > rules_[b].rank();
+	});
+}
+
 class MarriageAdvisor : public PersonVisitor {
 public:
-	MarriageAdvisor() : firstCandidate_(""), secondCandidate_(""), marriageAllowed_(false), currentNodeIsFirstCandidate(false) {};
-	MarriageAdvisor(string firstPerson, string secondPerson) : firstCandidate_(firstPerson), secondCandidate_(secondPerson), marriageAllowed_(false), currentNodeIsFirstCandidate(false) {};
+	// the rules read the genealogy through records, which may be a past version
+	MarriageAdvisor(Person *firstPerson, Person *secondPerson, KinshipRecords &records);
+	// rules added by callers may capture this advisor, so it must not be copied
+	MarriageAdvisor(const MarriageAdvisor &) = delete;
+	MarriageAdvisor &operator=(const MarriageAdvisor &) = delete;
 	void visit(Man *m);
 	void visit(Woman *w);
-	//Functions with Signature Type Man
-	bool candidatesNameMatchesCurrentNode(Man *m);
-	bool candidatesNotCurrentlyMarried(Man *m);
-	bool candidatesNotSiblings(Man *m);
-	bool candidatesNotAuntOrUncle(Man *m);
-	bool candidatesNotNieceOrNephew(Man *m);
-	bool candidatesNotCousins(Man *m);
-	bool candidatesNotParent(Man *m);
-	bool candidatesNotChild(Man *m);
-
-	//Functions with Signature Type Woman
-	bool candidatesNameMatchesCurrentNode(Woman *w);
-	bool candidatesNotCurrentlyMarried(Woman *w);
-	bool candidatesNotSiblings(Woman *w);
-	bool candidatesNotAuntOrUncle(Woman *w);
-	bool candidatesNotNieceOrNephew(Woman *w);
-	bool candidatesNotCousins(Woman *w);
-	bool candidatesNotParent(Woman *w);
-	bool candidatesNotChild(Woman *w);
+
+	// further rules (e.g. jurisdiction specific ones) are simply added;
+	// the planner decides when they run
+	void addRule(const MarriageRule &rule) { planner_.addRule(rule); }
+	// the rules as configured, for answering elsewhere (e.g. on shards)
+	const RulePlanner &planner() const { return planner_; }
+	// when set, a refusal also says how the candidates are related
+	void explainWith(const KinshipGraph *kinship) { kinship_ = kinship; }
+
+	bool candidatesMatchCurrentNode(Person *p);
 
 	//Generic output of marriage results
 	void outputMarriageResult();
 private:
-	string firstCandidate_;
-	string secondCandidate_;
-	bool currentNodeIsFirstCandidate;		//bool to track which candidate matches current node name
+	void adviseOn(Person *p);
+
+	Person *firstPerson_;
+	Person *secondPerson_;
+	bool currentNodeIsFirstCandidate;		//bool to track which candidate matches current node
 	bool marriageAllowed_;
+	KinshipRecords &records_;
+	const KinshipGraph *kinship_;
+	RulePlanner planner_;
 };
 
+MarriageAdvisor::MarriageAdvisor(Person *firstPerson, Person *secondPerson, KinshipRecords &records) :
+	firstPerson_(firstPerson), secondPerson_(secondPerson),
+	currentNodeIsFirstCandidate(false), marriageAllowed_(false),
+	records_(records), kinship_(nullptr) {
+	for (const auto &rule : standardMarriageRules())
+		addRule(rule);
+}
+
 //Function to output marital approval status for both man and woman
 void MarriageAdvisor::outputMarriageResult() {
 	if (marriageAllowed_ == true)
 		cout << "They can marry!" << endl;
-	else
+	else {
 		cout << "They cannot marry!" << endl;
+		// the path only explains refusals for being related by blood
+		const MarriageRule *rejection = planner_.lastRejection();
+		const Kinship kinship = kinship_ != nullptr && rejection != nullptr && rejection->byBlood
+			? kinship_->relate(firstPerson_, secondPerson_) : Kinship{ false, 0, 0, {}, "" };
+		if (kinship.related && kinship.path.size() > 1) {
+			cout << fullNameOf(secondPerson_) << " is the " << kinship.relationship
+				<< " of " << fullNameOf(firstPerson_) << ":  ";
+			for (size_t i = 0; i < kinship.path.size(); ++i)
+				cout << (i > 0 ? " -> " : "") << fullNameOf(kinship.path[i]);
+			cout << endl;
+		}
+	}
 	exit(0);
 }
 
-void MarriageAdvisor::visit(Man *m) {
-	const string fullName = m->getFirstName() + " " + m->getLastName();
-	if (m->getFather() != nullptr) {
-		if (candidatesNameMatchesCurrentNode(m)) {
-			if (candidatesNotCurrentlyMarried(m)) {
-				if (candidatesNotSiblings(m)) {
-					if (candidatesNotAuntOrUncle(m)) {
-						if (candidatesNotNieceOrNephew(m)) {
-							if (candidatesNotCousins(m)) {
-								if (candidatesNotParent(m)) {
-									const auto &dadPtr = m->getFather();
-									Woman *momPtr = static_cast<Woman *>(dadPtr->getSpouse());
-									const auto &childrenVec = momPtr->getChildren();
-									if (childrenVec.empty() == false) {
-										if (candidatesNotChild(m)) {
-											marriageAllowed_ = true;
-											outputMarriageResult();
-										}
-									}
-									else {
-										marriageAllowed_ = true;
-										outputMarriageResult();
-									}
-								}
-							}
-						}
-					}
-				}
-			}
-		}
+void MarriageAdvisor::visit(Man *m) { adviseOn(m); }
+void MarriageAdvisor::visit(Woman *w) { adviseOn(w); }
+
+// the first candidate found in the tree decides for both of them
+void MarriageAdvisor::adviseOn(Person *p) {
+	if (candidatesMatchCurrentNode(p)) {
+		Person *other = currentNodeIsFirstCandidate ? secondPerson_ : firstPerson_;
+		marriageAllowed_ = planner_.admits(records_, static_cast<int32_t>(p->getId()),
+			static_cast<int32_t>(other->getId()));
+		outputMarriageResult();
 	}
 }
 
-
-void MarriageAdvisor::visit(Woman *w) {
-	if (candidatesNameMatchesCurrentNode(w)) {
-		if (candidatesNotCurrentlyMarried(w)) {
-			if (candidatesNotSiblings(w)) {
-				if (candidatesNotAuntOrUncle(w)) {
-					if (candidatesNotNieceOrNephew(w)) {
-						if (candidatesNotCousins(w)) {
-							if (candidatesNotParent(w)) {
-								if (candidatesNotChild(w)) {
-									marriageAllowed_ = true;
-									outputMarriageResult();
-								}
-							}
-						}
-					}
-				}
-			}
-		}
+//Function to check if current node is either candidate
+bool MarriageAdvisor::candidatesMatchCurrentNode(Person *p) {
+	if (p == firstPerson_) {
+		currentNodeIsFirstCandidate = true;
+		return true;
+	}
+	else if (p == secondPerson_) {
+		currentNodeIsFirstCandidate = false;
+		return true;
 	}
+	return false;
 }
 
-//Woman * Function to check if current node matches either candidate name
-bool MarriageAdvisor::candidatesNameMatchesCurrentNode(Woman *w) {
-	//Try to fetch last name via father of woman
-	//If no father, try to fetch last name via spouse of woman
-	string lastName;
-	if (w->getFather()) {
-		Man *dadPtr = static_cast<Man *>(w->getFather());
-		lastName = dadPtr->getLastName();
+// name search over interned full names.
+// prefix lookups walk a compressed trie, typo tolerant lookups
+// count shared trigrams and verify survivors with a bounded edit distance.
+// names are compared case-insensitively; results are person ids, best first
+class NameIndex {
+public:
+	NameIndex();
+	explicit NameIndex(const PersonDirectory &directory);
+	void add(const string &fullName, unsigned personId);
+
+	vector<unsigned> lookup(const string &name, size_t limit = 5) const;
+	vector<unsigned> exactLookup(const string &name) const;
+	// shorter prefixes match too many names to mean anyone in particular
+	static const size_t minimumPrefixLength = 3;
+	vector<unsigned> prefixLookup(const string &prefix, size_t limit = 5) const;
+	vector<unsigned> fuzzyLookup(const string &name, unsigned maxEdits = 2, size_t limit = 5) const;
+private:
+	struct TrieNode {
+		string label;				// edge label leading into this node
+		vector<unsigned> children;	// node indices, sorted by first label character
+		int nameId;					// interned name ending here, or -1
+		int shortest;				// the name below this node that is listed first, or -1
+	};
+	static string fold(const string &name);
+	static vector<uint32_t> trigramsOf(const string &folded);
+	static unsigned boundedEditDistance(const string &a, const string &b, unsigned bound);
+	void insertIntoTrie(const string &folded, unsigned nameId);
+	bool listedBefore(unsigned nameId, unsigned otherNameId) const;
+	void keepShortest(unsigned node, unsigned nameId);
+	void appendPersons(const vector<unsigned> &nameIds, vector<unsigned> &personIds, size_t limit) const;
+
+	// a name within k edits of the query is at most k characters longer or
+	// shorter, so postings are kept per name length and only 2k + 1 are read
+	static uint64_t postingKey(size_t length, uint32_t trigram) { return uint64_t(length) << 24 | trigram; }
+	void collectSurvivors(const vector<uint32_t> &trigrams, size_t length, int required,
+		vector<std::pair<unsigned, unsigned>> &survivors) const;
+	// bounds on the work of one fuzzy lookup per name length: postings
+	// scanned for candidates, and names passing the filter that are verified
+	static const size_t maxScanned = 1024;
+	static const size_t maxVerified = 256;
+
+	vector<string> names_;						// folded, by name id
+	vector<vector<unsigned>> personsByName_;
+	vector<vector<unsigned>> namesByLength_;	// ascending name ids
+	std::unordered_map<string, unsigned> nameIds_;
+	vector<TrieNode> trie_;						// trie_[0] is the root
+	std::unordered_map<uint64_t, vector<unsigned>> postings_;	// (name length, trigram) -> ascending name ids
+};
+
+NameIndex::NameIndex() : trie_(1, TrieNode{ "", {}, -1, -1 }) {}
+
+NameIndex::NameIndex(const PersonDirectory &directory) : NameIndex() {
+	for (const auto &p : directory.people()) {
+		const string name = p != nullptr ? fullNameOf(p) : "";
+		if (!name.empty())
+			add(name, p->getId());
 	}
-	else {
-		if (w->getSpouse()) {
-			Man *spousePtr = static_cast<Man *>(w->getSpouse());
-			lastName = spousePtr->getLastName();
+}
+
+// lower case, without surrounding whitespace
+string NameIndex::fold(const string &name) {
+	size_t from = 0, to = name.size();
+	while (from < to && std::isspace(static_cast<unsigned char>(name[from])))
+		++from;
+	while (to > from && std::isspace(static_cast<unsigned char>(name[to - 1])))
+		--to;
+	string folded;
+	for (size_t i = from; i < to; ++i)
+		folded += static_cast<char>(std::tolower(static_cast<unsigned char>(name[i])));
+	return folded;
+}
+
+// names are padded so that their first and last letters weigh as much as inner ones
+vector<uint32_t> NameIndex::trigramsOf(const string &folded) {
+	const string padded = "\1\1" + folded + "\1\1";
+	vector<uint32_t> trigrams;
+	for (size_t i = 0; i + 3 <= padded.size(); ++i)
+		trigrams.push_back(static_cast<unsigned char>(padded[i]) << 16
+			| static_cast<unsigned char>(padded[i + 1]) << 8
+			| static_cast<unsigned char>(padded[i + 2]));
+	std::sort(trigrams.begin(), trigrams.end());
+	trigrams.erase(std::unique(trigrams.begin(), trigrams.end()), trigrams.end());
+	return trigrams;
+}
+
+// Levenshtein distance restricted to a band of width bound around the diagonal;
+// any distance above bound is reported as bound + 1
+unsigned NameIndex::boundedEditDistance(const string &a, const string &b, unsigned bound) {
+	const size_t n = a.size(), m = b.size();
+	if ((n > m ? n - m : m - n) > bound)
+		return bound + 1;
+	const unsigned over = bound + 1;
+	vector<unsigned> previous(m + 1), current(m + 1);
+	for (size_t j = 0; j <= m; ++j)
+		previous[j] = j <= bound ? static_cast<unsigned>(j) : over;
+	for (size_t i = 1; i <= n; ++i) {
+		const size_t from = i > bound ? i - bound : 1;
+		const size_t to = std::min(m, i + bound);
+		std::fill(current.begin(), current.end(), over);
+		current[0] = i <= bound ? static_cast<unsigned>(i) : over;
+		unsigned rowMinimum = current[0];
+		for (size_t j = from; j <= to; ++j) {
+			unsigned best = previous[j - 1] + (a[i - 1] == b[j - 1] ? 0 : 1);
+			best = std::min(best, previous[j] + 1);
+			best = std::min(best, current[j - 1] + 1);
+			current[j] = std::min(best, over);
+			rowMinimum = std::min(rowMinimum, current[j]);
 		}
-		else
-			return false;
+		if (rowMinimum > bound)
+			return over;
+		std::swap(previous, current);
 	}
-	string fullName = w->getFirstName() + " " + lastName;
-	if (fullName == firstCandidate_) {
-		currentNodeIsFirstCandidate = true;
-		return true;
+	return previous[m];
+}
+
+void NameIndex::add(const string &fullName, unsigned personId) {
+	const string folded = fold(fullName);
+	auto found = nameIds_.find(folded);
+	if (found == nameIds_.end()) {
+		const unsigned nameId = static_cast<unsigned>(names_.size());
+		found = nameIds_.emplace(folded, nameId).first;
+		names_.push_back(folded);
+		personsByName_.emplace_back();
+		insertIntoTrie(folded, nameId);
+		if (folded.size() >= namesByLength_.size())
+			namesByLength_.resize(folded.size() + 1);
+		namesByLength_[folded.size()].push_back(nameId);
+		for (uint32_t trigram : trigramsOf(folded))
+			postings_[postingKey(folded.size(), trigram)].push_back(nameId);
 	}
-	else {
-		if (fullName == secondCandidate_) {
-			currentNodeIsFirstCandidate = false;
-			return true;
+	personsByName_[found->second].push_back(personId);
+}
+
+void NameIndex::insertIntoTrie(const string &folded, unsigned nameId) {
+	unsigned node = 0;
+	size_t position = 0;
+	while (position < folded.size()) {
+		keepShortest(node, nameId);
+		auto &children = trie_[node].children;
+		auto next = std::lower_bound(children.begin(), children.end(), folded[position],
+			[this](unsigned child, char c) { return trie_[child].label[0] < c; });
+		if (next == children.end() || trie_[*next].label[0] != folded[position]) {
+			// no edge starts with this character: hang the rest of the name here
+			const unsigned leaf = static_cast<unsigned>(trie_.size());
+			children.insert(next, leaf);
+			trie_.push_back(TrieNode{ folded.substr(position), {}, static_cast<int>(nameId), static_cast<int>(nameId) });
+			return;
 		}
-		else {
-			return false;
+		const unsigned child = *next;
+		const size_t slot = next - children.begin();
+		const string label = trie_[child].label;
+		size_t common = 0;
+		while (common < label.size() && position + common < folded.size()
+			&& label[common] == folded[position + common])
+			++common;
+		if (common < label.size()) {
+			// split the edge; the existing child keeps the tail of its label
+			const unsigned middle = static_cast<unsigned>(trie_.size());
+			trie_.push_back(TrieNode{ label.substr(0, common), { child }, -1, trie_[child].shortest });
+			trie_[child].label.erase(0, common);
+			trie_[node].children[slot] = middle;
+			node = middle;
 		}
+		else
+			node = child;
+		position += common;
 	}
+	keepShortest(node, nameId);
+	trie_[node].nameId = static_cast<int>(nameId);
 }
 
-//Woman * Function to check if candidate is already married
-bool MarriageAdvisor::candidatesNotCurrentlyMarried(Woman *w) {
-	if (w->getSpouse() != nullptr) {
-		outputMarriageResult();
-		return false;
-	}else
-		return true;
+// prefix matches are listed shortest first, then alphabetically
+bool NameIndex::listedBefore(unsigned nameId, unsigned otherNameId) const {
+	const string &name = names_[nameId], &other = names_[otherNameId];
+	return name.size() != other.size() ? name.size() < other.size() : name < other;
 }
 
-//Woman * Function to check if candidates are siblings
-bool MarriageAdvisor::candidatesNotSiblings(Woman *w) {
-	Man *fatherPtr = static_cast<Man *>(w->getFather());
-	Woman *motherPtr = static_cast<Woman *>(fatherPtr->getSpouse());
-	const auto &siblingsVec = motherPtr->getChildren();
-	for (const auto &sibling : siblingsVec) {
-		const string siblingName = sibling->getFirstName() + " " + fatherPtr->getLastName();
-		if (currentNodeIsFirstCandidate == true) {
-			if (secondCandidate_ == siblingName)
-				outputMarriageResult();
+void NameIndex::keepShortest(unsigned node, unsigned nameId) {
+	if (trie_[node].shortest < 0 || listedBefore(nameId, static_cast<unsigned>(trie_[node].shortest)))
+		trie_[node].shortest = static_cast<int>(nameId);
+}
+
+void NameIndex::appendPersons(const vector<unsigned> &nameIds, vector<unsigned> &personIds, size_t limit) const {
+	for (unsigned nameId : nameIds)
+		for (unsigned personId : personsByName_[nameId]) {
+			if (personIds.size() >= limit)
+				return;
+			if (std::find(personIds.begin(), personIds.end(), personId) == personIds.end())
+				personIds.push_back(personId);
 		}
-		else {
-			if (firstCandidate_ == siblingName)
-				outputMarriageResult();
+}
+
+vector<unsigned> NameIndex::exactLookup(const string &name) const {
+	const auto found = nameIds_.find(fold(name));
+	return found != nameIds_.end() ? personsByName_[found->second] : vector<unsigned>();
+}
+
+// names starting with prefix, shortest first, then alphabetically
+vector<unsigned> NameIndex::prefixLookup(const string &prefix, size_t limit) const {
+	const string folded = fold(prefix);
+	if (folded.size() < minimumPrefixLength)
+		return {};
+	unsigned node = 0;
+	size_t position = 0;
+	while (position < folded.size()) {
+		const auto &children = trie_[node].children;
+		auto next = std::find_if(children.begin(), children.end(),
+			[&](unsigned child) { return trie_[child].label[0] == folded[position]; });
+		if (next == children.end())
+			return {};
+		const string &label = trie_[*next].label;
+		const size_t compared = std::min(label.size(), folded.size() - position);
+		if (label.compare(0, compared, folded, position, compared) != 0)
+			return {};
+		node = *next;
+		position += compared;
+	}
+	// best first through the subtree: a node is ranked by the first name
+	// listed below it, so names come out in order and only the nodes on
+	// the way to the first limit names are expanded
+	typedef std::pair<unsigned, int> Entry;		// (name id, node, or -1 for the name itself)
+	auto later = [this](const Entry &a, const Entry &b) { return listedBefore(b.first, a.first); };
+	std::priority_queue<Entry, vector<Entry>, decltype(later)> frontier(later);
+	if (trie_[node].shortest >= 0)
+		frontier.emplace(static_cast<unsigned>(trie_[node].shortest), static_cast<int>(node));
+	vector<unsigned> personIds;
+	while (!frontier.empty() && personIds.size() < limit) {
+		const Entry entry = frontier.top();
+		frontier.pop();
+		if (entry.second < 0) {
+			appendPersons({ entry.first }, personIds, limit);
+			continue;
 		}
+		const TrieNode &reached = trie_[entry.second];
+		if (reached.nameId >= 0)
+			frontier.emplace(static_cast<unsigned>(reached.nameId), -1);
+		for (unsigned child : reached.children)
+			frontier.emplace(static_cast<unsigned>(trie_[child].shortest), static_cast<int>(child));
 	}
-	return true;
+	return personIds;
 }
 
-//Woman * Function to check if candidates are Aunt/Uncle
-bool MarriageAdvisor::candidatesNotAuntOrUncle(Woman *w) {
-	Man *fatherPtr = static_cast<Man *>(w->getFather());
-	const auto &motherPtr = fatherPtr->getSpouse();
-	Man *dadsFather = static_cast<Man *>(fatherPtr->getFather());
-	Man *momsFather = static_cast<Man *>(motherPtr->getFather());
-	Woman *dadsMother = static_cast<Woman *>(dadsFather->getSpouse());
-	Woman *momsMother = static_cast<Woman *>(momsFather->getSpouse());
-	const auto &momsSideVec = momsMother->getChildren();
-	const auto &dadsSideVec = dadsMother->getChildren();
-	
-	//Check mom's brothers and sisters 
-	for (const auto &auntOrUncle : momsSideVec) {
-		Man *dadPtr = static_cast<Man *>(auntOrUncle->getFather());
-		const string auntOrUncleName = auntOrUncle->getFirstName() + " " + dadPtr->getLastName();
-		if (currentNodeIsFirstCandidate == true) {
-			if (secondCandidate_ == auntOrUncleName)
-				outputMarriageResult();
-		}else{
-			if (firstCandidate_ == auntOrUncleName)
-				outputMarriageResult();
-		}
+// names of one length sharing at least required trigrams with the query,
+// with the number they share. the lists are read rarest first: a name in
+// none of the first |T| - required + 1 of them shares too few, so only
+// those lists are scanned and the longer ones are searched per candidate.
+// when even the rarest lists are long, scanning stops after maxScanned
+// postings; names sharing only common trigrams with the query are then missed
+void NameIndex::collectSurvivors(const vector<uint32_t> &trigrams, size_t length, int required,
+	vector<std::pair<unsigned, unsigned>> &survivors) const {
+	static const vector<unsigned> noNames;
+	vector<const vector<unsigned> *> lists;
+	for (uint32_t trigram : trigrams) {
+		const auto postings = postings_.find(postingKey(length, trigram));
+		lists.push_back(postings != postings_.end() ? &postings->second : &noNames);
 	}
+	std::sort(lists.begin(), lists.end(),
+		[](const vector<unsigned> *a, const vector<unsigned> *b) { return a->size() < b->size(); });
+	const size_t seeding = lists.size() - required + 1;
 
-	//Check dad's brothers and sisters
-	for (const auto &auntOrUncle : dadsSideVec) {
-		Man *dadPtr = static_cast<Man *>(auntOrUncle->getFather());
-		const string auntOrUncleName = auntOrUncle->getFirstName() + " " + dadPtr->getLastName();
-		if (currentNodeIsFirstCandidate == true) {
-			if (secondCandidate_ == auntOrUncleName)
-				outputMarriageResult();
-		}
-		else {
-			if (firstCandidate_ == auntOrUncleName)
-				outputMarriageResult();
+	vector<unsigned> seeded;
+	size_t scanned = 0;
+	for (; scanned < seeding && (scanned == 0 || seeded.size() + lists[scanned]->size() <= maxScanned); ++scanned) {
+		const size_t merged = seeded.size();
+		seeded.insert(seeded.end(), lists[scanned]->begin(), lists[scanned]->end());
+		std::inplace_merge(seeded.begin(), seeded.begin() + merged, seeded.end());
+	}
+
+	// candidates come in ascending order, so every longer list
+	// is searched forward from where the previous candidate stopped
+	vector<size_t> cursors(lists.size(), 0);
+	for (size_t from = 0; from < seeded.size();) {
+		const unsigned nameId = seeded[from];
+		size_t to = from;
+		while (to < seeded.size() && seeded[to] == nameId)
+			++to;
+		unsigned shared = static_cast<unsigned>(to - from);
+		from = to;
+		for (size_t i = scanned; i < lists.size() && shared + (lists.size() - i) >= static_cast<size_t>(required); ++i) {
+			const vector<unsigned> &list = *lists[i];
+			size_t &cursor = cursors[i], step = 1;
+			while (cursor + step < list.size() && list[cursor + step] < nameId)
+				step *= 2;
+			cursor = std::lower_bound(list.begin() + cursor, list.begin() + std::min(cursor + step, list.size()), nameId)
+				- list.begin();
+			if (cursor < list.size() && list[cursor] == nameId)
+				++shared;
 		}
+		if (shared >= static_cast<unsigned>(required))
+			survivors.emplace_back(shared, nameId);
 	}
-	return true;
 }
 
-//Woman * Function to check if candidates are nieces/nephews
-bool MarriageAdvisor::candidatesNotNieceOrNephew(Woman *w) {
-	Man *fatherPtr = static_cast<Man *>(w->getFather());
-	Woman *motherPtr = static_cast<Woman *>(fatherPtr->getSpouse());
-	const auto &siblingsVec = motherPtr->getChildren();
-
-	for (const auto &sibling : siblingsVec) {
-		Woman *siblingPtr = static_cast<Woman *>(sibling);
-		const auto &niecesAndNephews = motherPtr->getChildren();
-		for (const auto &nieceOrNephew : niecesAndNephews) {
-			Man *fatherPtr = static_cast<Man *>(nieceOrNephew->getFather());
-			string nieceOrNephewName = nieceOrNephew->getFirstName() + " " + fatherPtr->getLastName();
-			if (currentNodeIsFirstCandidate == true) {
-				if (secondCandidate_ == nieceOrNephewName)
-					outputMarriageResult();
-			}
-			else {
-				if (firstCandidate_ == nieceOrNephewName)
-					outputMarriageResult();
-			}
+// names within maxEdits edits of name, closest first
+vector<unsigned> NameIndex::fuzzyLookup(const string &name, unsigned maxEdits, size_t limit) const {
+	const string folded = fold(name);
+	const vector<uint32_t> trigrams = trigramsOf(folded);
+	// every edit destroys at most three trigrams, so a match shares at least this many
+	const int required = static_cast<int>(trigrams.size()) - 3 * static_cast<int>(maxEdits);
+
+	vector<std::pair<unsigned, unsigned>> survivors;	// (shared trigrams, name id)
+	const size_t shortest = folded.size() > maxEdits ? folded.size() - maxEdits : 0;
+	for (size_t length = shortest; length <= folded.size() + maxEdits && length < namesByLength_.size(); ++length) {
+		if (required > 0)
+			collectSurvivors(trigrams, length, required, survivors);
+		else {
+			// the query is too short for the trigram filter to prune anything
+			for (size_t i = 0; i < namesByLength_[length].size() && survivors.size() < maxVerified; ++i)
+				survivors.emplace_back(0, namesByLength_[length][i]);
 		}
 	}
-	return true;
+	// the names sharing the most trigrams are the likeliest matches
+	if (survivors.size() > maxVerified) {
+		std::nth_element(survivors.begin(), survivors.begin() + maxVerified, survivors.end(),
+			std::greater<std::pair<unsigned, unsigned>>());
+		survivors.resize(maxVerified);
+	}
+
+	vector<std::pair<unsigned, unsigned>> matches;	// (distance, name id)
+	for (const auto &survivor : survivors) {
+		const unsigned distance = boundedEditDistance(folded, names_[survivor.second], maxEdits);
+		if (distance <= maxEdits)
+			matches.emplace_back(distance, survivor.second);
+	}
+	std::sort(matches.begin(), matches.end());
+	vector<unsigned> nameIds;
+	for (const auto &match : matches)
+		nameIds.push_back(match.second);
+	vector<unsigned> personIds;
+	appendPersons(nameIds, personIds, limit);
+	return personIds;
 }
 
-//Woman * Function to check if candidates are cousins
-bool MarriageAdvisor::candidatesNotCousins(Woman *w) {
-	Man *fatherPtr = static_cast<Man *>(w->getFather());
-	const auto &motherPtr = fatherPtr->getSpouse();
-	Man *dadsFather = static_cast<Man *>(fatherPtr->getFather());
-	Man *momsFather = static_cast<Man *>(motherPtr->getFather());
-	Woman *dadsMother = static_cast<Woman *>(dadsFather->getSpouse());
-	Woman *momsMother = static_cast<Woman *>(momsFather->getSpouse());
-	const auto &momsSideVec = momsMother->getChildren();
-	const auto &dadsSideVec = dadsMother->getChildren();
-
-	//Check mom's side of the family
-	//Nested For-range loops to iterate through each aunt/uncle
-	//And then iterate through all the cousins of each aunt/uncle
-	for (const auto &auntOrUncle : momsSideVec) {
-		Woman *auntOrUnclePtr = static_cast<Woman *>(auntOrUncle);
-		const auto &cousinsVec = auntOrUnclePtr->getChildren();
-		for (const auto &cousin : cousinsVec) {
-			Man *dadPtr = static_cast<Man *>(cousin->getFather());
-			const string cousinName = cousin->getFirstName() + " " + dadPtr->getLastName();
-			if (currentNodeIsFirstCandidate == true) {
-				if (secondCandidate_ == cousinName)
-					outputMarriageResult();
-			}else{
-				if (firstCandidate_ == cousinName)
-					outputMarriageResult();
-			}
-		}
+// exact matches first, then names the input is a prefix of, then near misses
+vector<unsigned> NameIndex::lookup(const string &name, size_t limit) const {
+	if (fold(name).empty())
+		return {};
+	vector<unsigned> personIds = exactLookup(name);
+	if (personIds.size() > limit)
+		personIds.resize(limit);
+	// short names tolerate fewer typos, which also keeps the trigram filter selective
+	const unsigned maxEdits = std::min<unsigned>(2, static_cast<unsigned>(fold(name).size() / 4));
+	for (const auto &more : { prefixLookup(name, limit), fuzzyLookup(name, maxEdits, limit) })
+		for (unsigned personId : more)
+			if (personIds.size() < limit
+				&& std::find(personIds.begin(), personIds.end(), personId) == personIds.end())
+				personIds.push_back(personId);
+	return personIds;
+}
+
+#if defined(__unix__) || defined(__APPLE__)
+// sharding: persons are split by family cluster, each shard is served by
+// its own worker process, and a router in the parent process dispatches
+// eligibility queries. workers are started empty and the router passes each
+// record it is given on to the owning shard without keeping it; a routing
+// table from person id to shard is the one structure covering everyone, and
+// it exists once, in shared memory.
+// workers fetch relatives living on other shards from the owning worker.
+// all traffic goes through single producer, single consumer rings in shared
+// memory, one ring per direction between every pair of processes. a process
+// with nothing to do sleeps until a peer rings its doorbell, a pipe written
+// to only when the process has said it is going to sleep
+
+// one message between the router and the shard workers
+struct ShardMessage {
+	enum Kind : uint32_t { Load, Loaded, Query, Verdict, Lookup, Record, Shutdown };
+	uint32_t kind;
+	uint32_t tag;		// pairs each reply with its request
+	int32_t person;		// first candidate of a query, the person loaded or looked up (-1 if unknown)
+	int32_t other;		// second candidate of a query, or 1/0 in a verdict
+	int32_t father, mother, spouse;		// the record loaded, or returned for a lookup
+};
+
+// lock-free queue for exactly one writer and one reader process
+struct MessageRing {
+	static const uint32_t capacity = 1024;
+	std::atomic<uint32_t> head;		// next slot to read
+	std::atomic<uint32_t> tail;		// next slot to write
+	ShardMessage slots[capacity];
+
+	bool push(const ShardMessage &message) {
+		const uint32_t t = tail.load(std::memory_order_relaxed);
+		if (t - head.load(std::memory_order_acquire) == capacity)
+			return false;
+		slots[t % capacity] = message;
+		tail.store(t + 1, std::memory_order_release);
+		return true;
 	}
+	bool pop(ShardMessage &message) {
+		const uint32_t h = head.load(std::memory_order_relaxed);
+		if (h == tail.load(std::memory_order_acquire))
+			return false;
+		message = slots[h % capacity];
+		head.store(h + 1, std::memory_order_release);
+		return true;
+	}
+	bool empty() const { return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire); }
+	bool full() const { return tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire) == capacity; }
+};
+// the guarantee for int covers unsigned int, the type uint32_t names
+static_assert(ATOMIC_INT_LOCK_FREE == 2 && sizeof(uint32_t) == sizeof(unsigned), "rings are shared between processes");
 
-	//Check dad's side of the family
-	//Nested For-range loops to iterate through each aunt/uncle
-	//And then iterate through all the cousins of each aunt/uncle
-	for (const auto &auntOrUncle : dadsSideVec) {
-		Woman *auntOrUnclePtr = static_cast<Woman *>(auntOrUncle);
-		const auto &cousinsVec = auntOrUnclePtr->getChildren();
-		for (const auto &cousin : cousinsVec) {
-			Man *dadPtr = static_cast<Man *>(cousin->getFather());
-			const string cousinName = cousin->getFirstName() + " " + dadPtr->getLastName();
-			if (currentNodeIsFirstCandidate == true) {
-				if (secondCandidate_ == cousinName)
-					outputMarriageResult();
-			}
-			else {
-				if (firstCandidate_ == cousinName)
-					outputMarriageResult();
-			}
+// the memory shared by all processes: the rings, where endpoint 0 is the
+// router and endpoint s + 1 the worker for shard s, a sleeping flag per
+// endpoint and the routing table, which names the owning endpoint of each
+// person and 0 for ids not loaded. the doorbells are created before the
+// workers are forked, so every process holds all of them
+class ShardChannels {
+public:
+	ShardChannels(unsigned shardCount, size_t population);
+	~ShardChannels();
+	unsigned endpoints() const { return endpoints_; }
+	MessageRing &between(unsigned from, unsigned to) { return rings_[from * endpoints_ + to]; }
+	size_t population() const { return population_; }
+	uint32_t *ownerOf() { return ownerOf_; }	// written by the router while loading
+	void send(unsigned from, unsigned to, const ShardMessage &message);
+	void wake(unsigned endpoint);
+	void wait(unsigned endpoint, const std::function<bool()> &ready);
+private:
+	unsigned endpoints_;
+	size_t population_;
+	size_t bytes_;
+	MessageRing *rings_;
+	std::atomic<uint32_t> *sleeping_;		// set by an endpoint about to sleep
+	uint32_t *ownerOf_;
+	vector<std::array<int, 2>> doorbells_;	// a pipe per endpoint, read and write end
+};
+
+ShardChannels::ShardChannels(unsigned shardCount, size_t population) :
+	endpoints_(shardCount + 1), population_(population),
+	bytes_(sizeof(MessageRing) * endpoints_ * endpoints_ + sizeof(uint32_t) * (endpoints_ + population)) {
+	// anonymous shared memory starts zeroed, so every ring starts empty
+	void *memory = mmap(nullptr, bytes_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (memory == MAP_FAILED) {
+		cout << "Could not map shared memory for the shards." << endl;
+		exit(1);
+	}
+	rings_ = static_cast<MessageRing *>(memory);
+	for (unsigned i = 0; i < endpoints_ * endpoints_; ++i) {
+		new (&rings_[i].head) std::atomic<uint32_t>(0);
+		new (&rings_[i].tail) std::atomic<uint32_t>(0);
+	}
+	sleeping_ = reinterpret_cast<std::atomic<uint32_t> *>(rings_ + endpoints_ * endpoints_);
+	for (unsigned i = 0; i < endpoints_; ++i)
+		new (&sleeping_[i]) std::atomic<uint32_t>(0);
+	ownerOf_ = reinterpret_cast<uint32_t *>(sleeping_ + endpoints_);
+	// neither end may block: a full pipe already wakes its reader
+	doorbells_.resize(endpoints_);
+	for (auto &doorbell : doorbells_)
+		if (pipe(doorbell.data()) != 0 || fcntl(doorbell[0], F_SETFL, O_NONBLOCK) != 0
+			|| fcntl(doorbell[1], F_SETFL, O_NONBLOCK) != 0) {
+			cout << "Could not create the shard doorbells." << endl;
+			exit(1);
 		}
+}
+
+ShardChannels::~ShardChannels() {
+	for (const auto &doorbell : doorbells_) {
+		close(doorbell[0]);
+		close(doorbell[1]);
 	}
-	return true;
+	munmap(rings_, bytes_);
 }
 
-//Woman * Function to check if candidates are parents
-bool MarriageAdvisor::candidatesNotParent(Woman *w) {
-	Man *fatherPtr = static_cast<Man *>(w->getFather());
-	Woman *motherPtr = static_cast<Woman *>(w->getFather());
-	const string motherName = motherPtr->getFirstName() + " " + fatherPtr->getLastName();
-	const string fatherName = fatherPtr->getFirstName() + " " + fatherPtr->getLastName();
-	if (currentNodeIsFirstCandidate == true) {
-		if (secondCandidate_ == motherName || secondCandidate_ == fatherName)
-			outputMarriageResult();
-		else {
-			if (firstCandidate_ == motherName || secondCandidate_ == fatherName)
-				outputMarriageResult();
-		}
+// pushes a message, sleeping while the ring is full, and wakes the receiver
+void ShardChannels::send(unsigned from, unsigned to, const ShardMessage &message) {
+	MessageRing &ring = between(from, to);
+	while (!ring.push(message))
+		wait(from, [&ring] { return !ring.full(); });
+	wake(to);
+}
+
+// rings the doorbell of an endpoint that has said it is going to sleep. the
+// fence orders the caller's last push or pop before reading the flag
+void ShardChannels::wake(unsigned endpoint) {
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (sleeping_[endpoint].load(std::memory_order_relaxed) == 0 || sleeping_[endpoint].exchange(0) == 0)
+		return;
+	const char bell = 0;
+	if (write(doorbells_[endpoint][1], &bell, 1) < 0) {
+		// the pipe is full, so the sleeper is being woken anyway
 	}
+}
 
-	const auto &childrenVec = w->getChildren();
-	for (const auto &child : childrenVec) {
-		Man *dadPtr = static_cast<Man *>(child->getFather());
-		const string childName = child->getFirstName() + " " + dadPtr->getLastName();
-		if (currentNodeIsFirstCandidate == true) {
-			if (secondCandidate_ == childName)
-				outputMarriageResult();
-		}
-		else {
-			if (firstCandidate_ == childName)
-				outputMarriageResult();
-		}
+// sleeps until the doorbell rings, unless ready() holds once the flag is
+// set: a peer pushing after that check is bound to see the flag. a busy
+// peer usually answers within a few time slices, so those are yielded
+// first. returns after at most a fifth of a second so callers can look
+// after their peers
+void ShardChannels::wait(unsigned endpoint, const std::function<bool()> &ready) {
+	const unsigned yields = 16;
+	for (unsigned i = 0; i < yields; ++i) {
+		if (ready())
+			return;
+		std::this_thread::yield();
+	}
+	sleeping_[endpoint].store(1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (!ready()) {
+		pollfd doorbell{ doorbells_[endpoint][0], POLLIN, 0 };
+		::poll(&doorbell, 1, 200);
+	}
+	sleeping_[endpoint].store(0, std::memory_order_relaxed);
+	char rung[64];
+	while (read(doorbells_[endpoint][0], rung, sizeof rung) > 0) {
 	}
-	return false;
 }
 
-//Woman * Function to check if candidates are children
-bool MarriageAdvisor::candidatesNotChild(Woman *w) {
-	const auto &childrenVec = w->getChildren();
+// serves one shard: answers queries routed to it and lookups from other shards.
+// queries run the same rules as MarriageAdvisor; the records they fetch come
+// from this shard or, through the rings, from the shard that owns them.
+// a worker whose router has died exits instead of waiting forever
+class ShardWorker : public KinshipRecords {
+public:
+	ShardWorker(unsigned shard, ShardChannels &channels, const RulePlanner &planner, pid_t router) :
+		self_(shard + 1), channels_(channels), planner_(planner), router_(router),
+		nextTag_(0), stopping_(false) {}
+	void run();
+	bool fetch(int32_t id, KinshipRecord &record);
+private:
+	bool poll();
+	void idle();
+
+	unsigned self_;
+	ShardChannels &channels_;
+	std::unordered_map<int32_t, KinshipRecord> records_;	// this shard's persons only, as loaded
+	RulePlanner planner_;
+	pid_t router_;
+	std::unordered_map<uint32_t, ShardMessage> replies_;	// lookups answered, by tag
+	// records fetched from other shards for the query being answered, and
+	// whether they exist; rules revisit the same relatives, and the records
+	// may change between queries, so this is emptied after every verdict
+	std::unordered_map<int32_t, std::pair<bool, KinshipRecord>> fetched_;
+	vector<ShardMessage> pending_;							// queries not yet answered
+	uint32_t nextTag_;
+	bool stopping_;
+};
 
-	for (const auto &child : childrenVec) {
-		Man *dadPtr = static_cast<Man *>(child);
-		const string childName = child->getFirstName() + " " + dadPtr->getLastName();
-		if (currentNodeIsFirstCandidate == true) {
-			if (secondCandidate_ == childName)
-				outputMarriageResult();
-		}else {
-			if (firstCandidate_ == childName)
-				outputMarriageResult();
+void ShardWorker::run() {
+	while (!stopping_ || !pending_.empty()) {
+		if (!pending_.empty()) {
+			const ShardMessage query = pending_.back();
+			pending_.pop_back();
+			ShardMessage verdict{ ShardMessage::Verdict, query.tag, query.person, 0, -1, -1, -1 };
+			verdict.other = planner_.admits(*this, query.person, query.other) ? 1 : 0;
+			fetched_.clear();
+			channels_.send(self_, 0, verdict);
 		}
+		else if (!poll())
+			idle();
 	}
-	return true;
 }
 
-//Man * Function to check if current node matches either candidate name
-bool MarriageAdvisor::candidatesNameMatchesCurrentNode(Man *m) {
-	string name = m->getFirstName() + " " + m->getLastName();
-	if (name == firstCandidate_) {
-		//cout << "Current Node Matches First Candidate!" << endl;
-		//cout << "\tMatching Node Name:  " << m->getFirstName() + " " + m->getLastName() << endl << "\tFirst Candidate Matching Name:  " << firstCandidate_ << endl;
-		currentNodeIsFirstCandidate = true;
-		return true;
-	}else {
-		if (name == secondCandidate_) {
-			//cout << "Current Node Matches Second Candidate!" << endl;
-			//cout << "\tMatching Node Name:  " << m->getFirstName() + " " + m->getLastName() << endl << "\tSecond Candidate Matching Name:  " << secondCandidate_ << endl;
-			currentNodeIsFirstCandidate = false;
-			return true;
+void ShardWorker::idle() {
+	channels_.wait(self_, [this] {
+		for (unsigned from = 0; from < channels_.endpoints(); ++from)
+			if (from != self_ && !channels_.between(from, self_).empty())
+				return true;
+		return false;
+	});
+	if (getppid() != router_)
+		_exit(1);
+}
+
+// drains every inbound ring once and wakes senders waiting for room.
+// lookups are answered right away from local records, so a worker waiting
+// on another never blocks a third
+bool ShardWorker::poll() {
+	bool received = false;
+	ShardMessage message;
+	for (unsigned from = 0; from < channels_.endpoints(); ++from) {
+		if (from == self_ || channels_.between(from, self_).empty())
+			continue;
+		received = true;
+		while (channels_.between(from, self_).pop(message)) {
+			if (message.kind == ShardMessage::Load)
+				records_[message.person] = KinshipRecord{ message.father, message.mother, message.spouse };
+			else if (message.kind == ShardMessage::Loaded)
+				channels_.send(self_, 0, message);
+			else if (message.kind == ShardMessage::Query)
+				pending_.push_back(message);
+			else if (message.kind == ShardMessage::Lookup) {
+				const auto found = records_.find(message.person);
+				ShardMessage reply{ ShardMessage::Record, message.tag, -1, 0, -1, -1, -1 };
+				if (found != records_.end())
+					reply = ShardMessage{ ShardMessage::Record, message.tag, message.person, 0,
+						found->second.father, found->second.mother, found->second.spouse };
+				channels_.send(self_, from, reply);
+			}
+			else if (message.kind == ShardMessage::Record)
+				replies_[message.tag] = message;
+			else if (message.kind == ShardMessage::Shutdown)
+				stopping_ = true;
 		}
-		else
-			return false;
+		channels_.wake(from);
 	}
+	return received;
 }
 
-//Man * Function to check if candidate is married
-bool MarriageAdvisor::candidatesNotCurrentlyMarried(Man *m) {
-	const auto &spousePtr = m->getSpouse();
-	if (spousePtr == nullptr) {
-		//cout << m->getFirstName() + " " + m->getLastName() << " is NOT married!" << endl;
+bool ShardWorker::fetch(int32_t id, KinshipRecord &record) {
+	if (id < 0 || static_cast<size_t>(id) >= channels_.population())
+		return false;
+	const unsigned owner = channels_.ownerOf()[id];
+	if (owner == 0)
+		return false;
+	if (owner == self_) {
+		const auto found = records_.find(id);
+		if (found == records_.end())
+			return false;
+		record = found->second;
 		return true;
 	}
-	else {
-		//cout << m->getFirstName() + " " + m->getLastName() << " IS married!" << endl;
-		//cout << "\tSpouse Name:  " << spousePtr->getFirstName() + " " + m->getLastName() << endl;
-		outputMarriageResult();
-		return false;
+	const auto known = fetched_.find(id);
+	if (known != fetched_.end()) {
+		record = known->second.second;
+		return known->second.first;
 	}
+	const uint32_t tag = nextTag_++;
+	channels_.send(self_, owner, ShardMessage{ ShardMessage::Lookup, tag, id, 0, -1, -1, -1 });
+	while (replies_.count(tag) == 0)
+		if (!poll())
+			idle();
+	const ShardMessage reply = replies_[tag];
+	replies_.erase(tag);
+	record = KinshipRecord{ reply.father, reply.mother, reply.spouse };
+	fetched_[id] = std::make_pair(reply.person >= 0, record);
+	return reply.person >= 0;
 }
 
-//Man * Function to check if candidates are siblings
-bool MarriageAdvisor::candidatesNotSiblings(Man *m) {
-	const auto &fatherPtr = m->getFather();	
-	Woman *motherPtr = static_cast<Woman *>(fatherPtr->getSpouse());
-	const auto &childrenVec = motherPtr->getChildren();
-
-	//For each child in childrenVec, get child's full name
-	//See if child name matches candidate name
-	//If not, return true.  Else, return false
-	for (const auto & child : childrenVec) {
-			const string childName = child->getFirstName() + " " + m->getLastName();
-			//cout << "Checking child " << childName << endl;
-			if (currentNodeIsFirstCandidate == true) {
-				if (secondCandidate_ == childName) {
-					outputMarriageResult();
-				}
-			}
-			else {
-				if (firstCandidate_ == childName) {
-					outputMarriageResult();
-				}
-			}
+// forks one worker per shard on construction and stops them on destruction.
+// records are streamed in with add, then finishLoading waits until every
+// shard has stored its own; the router itself keeps only the routing table
+class ShardRouter {
+public:
+	// every worker runs its own copy of the planner's rules
+	ShardRouter(unsigned shardCount, size_t population, const RulePlanner &planner);
+	~ShardRouter() { stopWorkers(); }
+	void add(int32_t id, const KinshipRecord &record);	// fathers before their children
+	void finishLoading();
+	vector<bool> canMarry(const vector<std::pair<int32_t, int32_t>> &pairs);
+private:
+	bool loaded(int32_t id) {
+		return id >= 0 && static_cast<size_t>(id) < channels_.population() && channels_.ownerOf()[id] != 0;
 	}
-	return true;
-}
+	void stopWorkers();
+	unsigned shardCount_;
+	ShardChannels channels_;
+	vector<pid_t> workers_;		// one per shard, in shard order
+};
 
-//Man * Function to check if candidates are Aunt/Uncle
-bool MarriageAdvisor::candidatesNotAuntOrUncle(Man *m) {
-	const auto &fatherPtr = m->getFather();
-	Woman *motherPtr = static_cast<Woman *>(fatherPtr->getSpouse());
-	if (fatherPtr->getFather() != nullptr) {
-		const auto &dadsFather = fatherPtr->getFather();
-		const auto &momsFather = motherPtr->getFather();
-		if (momsFather->getSpouse() != nullptr) {
-			Woman *momsMother = static_cast<Woman *>(momsFather->getSpouse());
-			const auto &momsSideVec = momsMother->getChildren();
-			//Check mom's brothers and sisters
-			if (momsSideVec.empty() == false) {
-				for (const auto &auntOrUncle : momsSideVec) {
-					Man *dadPtr = static_cast<Man *>(auntOrUncle->getFather());
-					const string auntOrUncleName = auntOrUncle->getFirstName() + " " + dadPtr->getLastName();
-					if (currentNodeIsFirstCandidate == true) {
-						if (secondCandidate_ == auntOrUncleName) {
-							outputMarriageResult();
-						}
-					}
-					else {
-						if (firstCandidate_ == auntOrUncleName) {
-							outputMarriageResult();
-						}
-					}
-				}
-			}
+// workers are forked before any record is built
+ShardRouter::ShardRouter(unsigned shardCount, size_t population, const RulePlanner &planner) :
+	shardCount_(shardCount), channels_(shardCount, population) {
+	cout.flush();
+	const pid_t router = getpid();
+	for (unsigned shard = 0; shard < shardCount; ++shard) {
+		const pid_t pid = fork();
+		if (pid == 0) {
+			ShardWorker(shard, channels_, planner, router).run();
+			_exit(0);
 		}
-		if (momsFather->getSpouse() != nullptr) {
-			Woman *dadsMother = static_cast<Woman *>(dadsFather->getSpouse());
-			const auto &dadsSideVec = dadsMother->getChildren();
-			//Check dad's brothers and sisters
-			if (dadsSideVec.empty() == true) {
-				for (const auto &auntOrUncle : dadsSideVec) {
-					Man *dadPtr = static_cast<Man *>(auntOrUncle->getFather());
-					const string auntOrUncleName = auntOrUncle->getFirstName() + " " + dadPtr->getLastName();
-					if (currentNodeIsFirstCandidate == true) {
-						if (secondCandidate_ == auntOrUncleName) {
-							outputMarriageResult();
-						}
-					}
-					else {
-						if (firstCandidate_ == auntOrUncleName)
-							outputMarriageResult();
-					}
-				}
-			}
+		if (pid < 0) {
+			stopWorkers();
+			cout << "Could not start a shard worker." << endl;
+			exit(1);
 		}
+		workers_.push_back(pid);
 	}
-	else {
-		outputMarriageResult();
+}
+
+// persons belong to the cluster of their topmost known paternal ancestor,
+// so a family line stays on one shard and in-laws are mostly elsewhere. a
+// father loaded first has already been routed to his cluster's shard, and
+// a person without one starts a cluster
+void ShardRouter::add(int32_t id, const KinshipRecord &record) {
+	if (id < 0 || static_cast<size_t>(id) >= channels_.population())
+		return;
+	uint32_t *owner = channels_.ownerOf();
+	if (loaded(record.father))
+		owner[id] = owner[record.father];
+	else	// spread clusters over the shards with a multiplicative hash
+		owner[id] = static_cast<uint32_t>((static_cast<uint32_t>(id) * 2654435761u) % shardCount_) + 1;
+	channels_.send(0, owner[id], ShardMessage{ ShardMessage::Load, 0, id, 0, record.father, record.mother, record.spouse });
+}
+
+// each worker echoes Loaded once everything sent before it is stored
+void ShardRouter::finishLoading() {
+	for (unsigned shard = 0; shard < shardCount_; ++shard)
+		channels_.send(0, shard + 1, ShardMessage{ ShardMessage::Loaded, 0, -1, -1, -1, -1, -1 });
+	ShardMessage reply;
+	for (unsigned shard = 0; shard < shardCount_; ++shard) {
+		MessageRing &ring = channels_.between(shard + 1, 0);
+		while (!ring.pop(reply))
+			channels_.wait(0, [&ring] { return !ring.empty(); });
+		channels_.wake(shard + 1);
 	}
+}
 
-	return true;
+void ShardRouter::stopWorkers() {
+	for (size_t shard = 0; shard < workers_.size(); ++shard)
+		channels_.send(0, static_cast<unsigned>(shard) + 1, ShardMessage{ ShardMessage::Shutdown, 0, -1, -1, -1, -1, -1 });
+	for (pid_t pid : workers_)
+		waitpid(pid, nullptr, 0);
+	workers_.clear();
 }
 
-//Man * Function to check if candidates are nieces/nephews
-bool MarriageAdvisor::candidatesNotNieceOrNephew(Man *m) {
-	const auto &fatherPtr = m->getFather();
-	Woman *motherPtr = static_cast<Woman *>(fatherPtr->getSpouse());
-	const auto &siblingsVec = motherPtr->getChildren();
-
-	for (const auto &sibling : siblingsVec) {
-		Woman *siblingPtr = static_cast<Woman *>(sibling);
-		const auto &niecesAndNephewsVec = siblingPtr->getChildren();
-		for (const auto &nieceOrNephew : niecesAndNephewsVec) {
-			Man *fatherPtr = static_cast<Man *>(nieceOrNephew->getFather());
-			string name = nieceOrNephew->getFirstName() + " " + fatherPtr->getLastName();
-			if (currentNodeIsFirstCandidate == true) {
-				if (secondCandidate_ == name)
-					outputMarriageResult();
+// each query goes to the shard of its first candidate. every shard has its
+// own queue, so a busy shard never holds up queries for the others; no shard
+// gets more queries in flight than its verdict ring can hold. with nothing
+// to send, the router sleeps until a verdict arrives. a candidate never
+// loaded cannot marry
+vector<bool> ShardRouter::canMarry(const vector<std::pair<int32_t, int32_t>> &pairs) {
+	vector<bool> verdicts(pairs.size(), false);
+	vector<vector<size_t>> queued(shardCount_);		// indices into pairs, per shard
+	size_t answered = 0;
+	for (size_t i = 0; i < pairs.size(); ++i)
+		if (loaded(pairs[i].first))
+			queued[channels_.ownerOf()[pairs[i].first] - 1].push_back(i);
+		else
+			++answered;
+	vector<size_t> sent(shardCount_, 0);
+	vector<uint32_t> inFlight(shardCount_, 0);
+	while (answered < pairs.size()) {
+		bool progress = false;
+		for (unsigned shard = 0; shard < shardCount_; ++shard) {
+			const size_t before = sent[shard];
+			while (sent[shard] < queued[shard].size() && inFlight[shard] < MessageRing::capacity) {
+				const size_t i = queued[shard][sent[shard]];
+				if (!channels_.between(0, shard + 1).push(ShardMessage{ ShardMessage::Query, static_cast<uint32_t>(i),
+					pairs[i].first, pairs[i].second, -1, -1, -1 }))
+					break;
+				++inFlight[shard];
+				++sent[shard];
 			}
-			else {
-				if (firstCandidate_ == name)
-					outputMarriageResult();
+			if (sent[shard] != before) {
+				channels_.wake(shard + 1);
+				progress = true;
+			}
+		}
+		ShardMessage verdict;
+		for (unsigned shard = 0; shard < shardCount_; ++shard) {
+			MessageRing &ring = channels_.between(shard + 1, 0);
+			if (ring.empty())
+				continue;
+			while (ring.pop(verdict)) {
+				verdicts[verdict.tag] = verdict.other == 1;
+				--inFlight[shard];
+				++answered;
 			}
+			channels_.wake(shard + 1);
+			progress = true;
 		}
+		// a query can only be held back by one not yet answered
+		if (!progress)
+			channels_.wait(0, [this] {
+				for (unsigned shard = 0; shard < shardCount_; ++shard)
+					if (!channels_.between(shard + 1, 0).empty())
+						return true;
+				return false;
+			});
 	}
+	return verdicts;
+}
+#endif
+
+// reads a calendar date written as YYYYMMDD
+bool parseDate(const string &text, long &date) {
+	if (text.size() != 8 || text.find_first_not_of("0123456789") != string::npos)
+		return false;
+	const long year = std::atol(text.substr(0, 4).c_str());
+	const int month = std::atoi(text.substr(4, 2).c_str());
+	const int day = std::atoi(text.substr(6, 2).c_str());
+	static const int daysInMonth[] = { 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
+	const bool leap = (year % 4 == 0 && year % 100 != 0) || year % 400 == 0;
+	if (month < 1 || month > 12 || day < 1
+		|| day > daysInMonth[month - 1] + (month == 2 && leap ? 1 : 0))
+		return false;
+	date = std::atol(text.c_str());
 	return true;
 }
 
-//Man * Function to check if candidates are cousins
-bool MarriageAdvisor::candidatesNotCousins(Man *m) {
-	const auto &fatherPtr = m->getFather();
-	Woman *motherPtr = static_cast<Woman *>(fatherPtr->getSpouse());
-	const auto &dadsFather = fatherPtr->getFather();
-	Woman *momsFather = static_cast<Woman *>(motherPtr->getFather());
-	Woman *dadsMother = static_cast<Woman *>(dadsFather->getSpouse());
-	Woman *momsMother = static_cast<Woman *>(momsFather->getSpouse());
-	const auto &momsSideVec = momsMother->getChildren();
-	const auto &dadsSideVec = dadsMother->getChildren();
-
-	//Check mom's side of the family
-	//Nested For-range loops to iterate through each aunt/uncle
-	//And then iterate through all the cousins of each aunt/uncle
-	for (const auto &auntOrUncle : momsSideVec) {
-		Woman *auntOrUnclePtr = static_cast<Woman *>(auntOrUncle);
-		const auto& cousinsVec = auntOrUnclePtr->getChildren();
-		for (const auto &cousin : cousinsVec) {
-			Man *fatherPtr = static_cast<Man *>(cousin->getFather());
-			string cousinName = cousin->getFirstName() + " " + fatherPtr->getLastName();
-			if (currentNodeIsFirstCandidate == true) {
-				if (secondCandidate_ == cousinName)
-					outputMarriageResult();
-			}else {
-				if (firstCandidate_ == cousinName)
-					outputMarriageResult();
+// resolves typed input to one person before any rule runs,
+// telling the user when a near miss was taken for someone
+Person *resolveCandidate(const NameIndex &index, const PersonDirectory &directory, const string &input) {
+	const vector<unsigned> matches = index.lookup(input);
+	if (input.find_first_not_of(" \t\r\n") == string::npos) {
+		cout << "No name was entered." << endl;
+		return nullptr;
+	}
+	if (matches.empty()) {
+		cout << "Nobody named \"" << input << "\" is in the tree." << endl;
+		return nullptr;
+	}
+	Person *p = directory.find(matches.front());
+	if (index.exactLookup(input).empty())
+		cout << "Taking \"" << input << "\" to mean " << fullNameOf(p) << "." << endl;
+	return p;
+}
+
+// compares KinshipGraph::relate with every common ancestor found by brute
+// force, on small random pedigrees where lines cross again and again;
+// returns the number of queries answered wrongly
+unsigned selfTestKinship(unsigned trees, unsigned queriesPerTree) {
+	std::mt19937 random(2029);
+	unsigned wrong = 0;
+	for (unsigned tree = 0; tree < trees; ++tree) {
+		// six generations of six, each person's parents drawn from
+		// the two generations above
+		const unsigned generations = 6, width = 6;
+		vector<Person *> people;
+		for (unsigned g = 0; g < generations; ++g)
+			for (unsigned i = 0; i < width; ++i) {
+				Person *father = nullptr, *mother = nullptr;
+				if (g > 0) {
+					// men are at even positions, women at odd ones
+					const unsigned from = g > 1 ? g - 2 : 0;
+					const unsigned couples = (g - from) * width / 2;
+					father = people[from * width + 2 * (random() % couples)];
+					mother = people[from * width + 2 * (random() % couples) + 1];
+					if (random() % 4 == 0)
+						(random() % 2 ? father : mother) = nullptr;
+				}
+				if (i % 2 == 0)
+					people.push_back(new Man("Test", "Man", father, mother));
+				else
+					people.push_back(new Woman("Woman", father, mother));
+			}
+
+		PersonDirectory directory(people);
+		KinshipGraph graph(directory);
+		// generations from a person up to each ancestor (and 0 to itself)
+		auto ancestry = [](Person *p) {
+			std::unordered_map<Person *, unsigned> depth = { { p, 0 } };
+			vector<Person *> level = { p };
+			for (unsigned d = 1; !level.empty(); ++d) {
+				vector<Person *> above;
+				for (Person *q : level)
+					for (Person *parent : { q->getFather(), q->getMother() })
+						if (parent != nullptr && depth.emplace(parent, d).second)
+							above.push_back(parent);
+				level.swap(above);
 			}
-		}	
-	}
-
-	//Check dad's side of the family
-	//Nested For-range loops to iterate through each aunt/uncle
-	//And then iterate through all the cousins of each aunt/uncle
-	for (const auto &auntOrUncle : dadsSideVec) {
-		Woman *auntOrUnclePtr = static_cast<Woman *>(auntOrUncle);
-		const auto& cousinsVec = auntOrUnclePtr->getChildren();
-		for (const auto &cousin : cousinsVec) {
-			Man *fatherPtr = static_cast<Man *>(cousin->getFather());
-			string cousinName = cousin->getFirstName() + " " + fatherPtr->getLastName();
-			if (currentNodeIsFirstCandidate == true) {
-				if (secondCandidate_ == cousinName)
-					outputMarriageResult();
+			return depth;
+		};
+		for (unsigned query = 0; query < queriesPerTree; ++query) {
+			Person *first = people[random() % people.size()];
+			Person *second = people[random() % people.size()];
+			const auto above = ancestry(first), below = ancestry(second);
+			unsigned shortest = ~0u;
+			for (const auto &ancestor : above) {
+				const auto shared = below.find(ancestor.first);
+				if (shared != below.end())
+					shortest = std::min(shortest, ancestor.second + shared->second);
 			}
-			else {
-				if (firstCandidate_ == cousinName)
-					outputMarriageResult();
+
+			const Kinship kinship = graph.relate(first, second);
+			bool right = kinship.related == (shortest != ~0u);
+			if (right && kinship.related) {
+				// a path of the shortest length, up by parent links then down by them
+				right = kinship.up + kinship.down == shortest && kinship.path.size() == shortest + 1
+					&& kinship.path.front() == first && kinship.path.back() == second;
+				for (size_t i = 0; right && i + 1 < kinship.path.size(); ++i) {
+					Person *child = i < kinship.up ? kinship.path[i] : kinship.path[i + 1];
+					Person *parent = i < kinship.up ? kinship.path[i + 1] : kinship.path[i];
+					right = child->getFather() == parent || child->getMother() == parent;
+				}
 			}
+			if (!right)
+				++wrong;
 		}
+		for (Person *p : people)
+			delete p;
 	}
-	return true;
+	return wrong;
 }
 
-//Man * Function to check if candidates are parents
-bool MarriageAdvisor::candidatesNotParent(Man *m) {
-	//First, check if candidates are Parents
-	const auto &fatherPtr = m->getFather();
-	Woman *motherPtr = static_cast<Woman *>(fatherPtr->getSpouse());
-	Man *father = static_cast<Man *>(m->getFather());
-	const string motherName = motherPtr->getFirstName() + " " + father->getLastName();
-	const string fatherName = fatherPtr->getFirstName() + " " + father->getLastName();
-	if (currentNodeIsFirstCandidate == true) {
-		if ((secondCandidate_ == motherName) || (secondCandidate_ == fatherName))
-			outputMarriageResult();
-	}else {
-		if ((firstCandidate_ == motherName) || (firstCandidate_ == fatherName))
-			outputMarriageResult();
-	}
-
-	//Second, check that candidates are not your children
-	Woman *mom = static_cast<Woman *>(m->getSpouse());
-	const auto &childrenVec = mom->getChildren();
-	for (const auto &child : childrenVec) {
-		Man *dadPtr = static_cast<Man *>(child->getFather());
-		const string childName = child->getFirstName() + " " + dadPtr->getLastName();
-		if (currentNodeIsFirstCandidate == true) {
-			if (firstCandidate_ == childName)
-				outputMarriageResult();
-		}else {
-			if (firstCandidate_ == childName)
-				outputMarriageResult();
+#if defined(__unix__) || defined(__APPLE__)
+// answers pairCount pairs drawn from a synthetic population of 100,000
+// through 1, 2, 4 and 8 shards (only through shardCount when it is not 0)
+// and reports pairs per second. every verdict is checked against the same
+// rules run in this process; returns whether all of them agreed
+bool benchShards(unsigned pairCount, unsigned shardCount) {
+	std::mt19937 random(2030);
+	// eight generations of 12,500. a third of the men marry the woman
+	// half a generation away, and each person's parents are a couple
+	// living close by, so persons close to each other are often cousins
+	const unsigned generations = 8, width = 12500;
+	const long generationLength = 250000;		// 25 years in YYYYMMDD steps
+	vector<Person *> people;
+	GenealogyHistory history;
+	auto wifeOf = [width](unsigned man) { return (man + width / 2 + 1) % width; };
+	for (unsigned g = 0; g < generations; ++g) {
+		// one date per generation keeps a single version for all its births
+		const long born = 18000101 + g * generationLength;
+		for (unsigned i = 0; i < width; ++i) {
+			Person *father = nullptr, *mother = nullptr;
+			if (g > 0) {
+				// men are at even positions, women at odd ones
+				const unsigned couple = std::min(width / 2 - 1, std::max(i / 2, 4u) - 4 + static_cast<unsigned>(random() % 9));
+				father = people[(g - 1) * width + 2 * couple];
+				mother = people[(g - 1) * width + wifeOf(2 * couple)];
+			}
+			if (i % 2 == 0)
+				people.push_back(new Man("Bench", "Man", father, mother));
+			else
+				people.push_back(new Woman("Woman", father, mother));
+			history.recordBirth(people.back(), born);
 		}
+		for (unsigned man = 0; man < width; man += 2)
+			if (random() % 3 == 0)
+				history.recordMarriage(people[g * width + man], people[g * width + wifeOf(man)], born + generationLength - 50000);
+	}
+
+	PersonDirectory directory(people);
+	TreeRecords records(directory);
+	RulePlanner planner;
+	for (const auto &rule : standardMarriageRules())
+		planner.addRule(rule);
+
+	// three in four pairs are near neighbours of the same generation
+	vector<std::pair<int32_t, int32_t>> pairs;
+	for (unsigned k = 0; k < pairCount; ++k) {
+		const unsigned first = random() % people.size();
+		unsigned second = random() % people.size();
+		if (random() % 4 != 0)
+			second = first - first % width + (first % width + width - 16 + random() % 33) % width;
+		pairs.push_back(std::make_pair(static_cast<int32_t>(people[first]->getId()),
+			static_cast<int32_t>(people[second]->getId())));
 	}
-	return true;
-}
 
-//Man * Function to check if candidates are children
-bool MarriageAdvisor::candidatesNotChild(Man *m) {
-	Woman *spousePtr = static_cast<Woman *>(m->getSpouse());
-	const auto &childrenVec = spousePtr->getChildren();
+	auto perSecond = [](size_t count, std::chrono::steady_clock::time_point start) {
+		const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+		return static_cast<unsigned long>(count / std::max(elapsed.count(), 1e-9));
+	};
+	RulePlanner local(planner);
+	vector<bool> expected;
+	auto start = std::chrono::steady_clock::now();
+	for (const auto &pair : pairs)
+		expected.push_back(local.admits(records, pair.first, pair.second));
+	const unsigned cores = std::thread::hardware_concurrency();
+	cout << pairs.size() << " pairs, " << std::count(expected.begin(), expected.end(), true) << " allowed, on "
+		<< cores << (cores == 1 ? " core" : " cores") << endl;
+	cout << "in this process: " << perSecond(pairs.size(), start) << " pairs/s" << endl;
 
-	for (const auto &child : childrenVec) {
-		Man *dadPtr = static_cast<Man *>(child);
-		const string childName = child->getFirstName() + " " + dadPtr->getLastName();
-		if (currentNodeIsFirstCandidate == true) {
-			if (secondCandidate_ == childName)
-				outputMarriageResult();
+	bool agreed = true;
+	for (unsigned count : shardCount > 0 ? vector<unsigned>{ shardCount } : vector<unsigned>{ 1, 2, 4, 8 }) {
+		ShardRouter router(count, directory.people().size(), planner);
+		KinshipRecord record;
+		for (size_t id = 0; id < directory.people().size(); ++id)
+			if (records.fetch(static_cast<int32_t>(id), record))
+				router.add(static_cast<int32_t>(id), record);
+		router.finishLoading();
+		start = std::chrono::steady_clock::now();
+		const bool same = router.canMarry(pairs) == expected;
+		cout << count << (count == 1 ? " shard:  " : " shards: ") << perSecond(pairs.size(), start) << " pairs/s"
+			<< (same ? "" : ", verdicts differ") << endl;
+		agreed = agreed && same;
+	}
+	for (Person *p : people)
+		delete p;
+	return agreed;
+}
+#endif
+
+// demonstrating the operation; "--shards N" answers through N worker processes,
+// "--self-test" checks the kinship search against brute force and "--bench N"
+// times N pairs through the shards instead
+int main(int argc, char *argv[]) {
+	// every pair of processes shares a ring, so the rings grow with the square of this
+	const long maxShards = 32, maxBenchPairs = 10000000;
+	unsigned shardCount = 0, benchPairs = 0;
+	for (int i = 1; i < argc; ++i) {
+		if (string(argv[i]) == "--self-test") {
+			const unsigned trees = 1000, queriesPerTree = 40;
+			const unsigned wrong = selfTestKinship(trees, queriesPerTree);
+			cout << "Kinship search: " << wrong << " of " << trees * queriesPerTree
+				<< " queries on random pedigrees answered wrongly." << endl;
+			return wrong == 0 ? 0 : 1;
 		}
-		else {
-			if (firstCandidate_ == childName)
-				outputMarriageResult();
+		if (string(argv[i]) == "--bench") {
+			const string value = i + 1 < argc ? argv[++i] : "";
+			const long count = std::strtol(value.c_str(), nullptr, 10);
+			if (value.empty() || value.find_first_not_of("0123456789") != string::npos
+				|| count < 1 || count > maxBenchPairs) {
+				cout << "--bench needs a whole number of pairs from 1 to " << maxBenchPairs << "." << endl;
+				return 1;
+			}
+			benchPairs = static_cast<unsigned>(count);
+			continue;
 		}
+		if (string(argv[i]) != "--shards")
+			continue;
+		const string value = i + 1 < argc ? argv[++i] : "";
+		const long count = std::strtol(value.c_str(), nullptr, 10);
+		if (value.empty() || value.find_first_not_of("0123456789") != string::npos
+			|| count < 1 || count > maxShards) {
+			cout << "--shards needs a whole number from 1 to " << maxShards << "." << endl;
+			return 1;
+		}
+		shardCount = static_cast<unsigned>(count);
+	}
+	if (benchPairs > 0) {
+#if defined(__unix__) || defined(__APPLE__)
+		return benchShards(benchPairs, shardCount) ? 0 : 1;
+#else
+		cout << "Sharding needs a POSIX system." << endl;
+		return 1;
+#endif
 	}
-	return true;
-}
 
-// demonstrating the operation
-int main() {
 
 	// setting up the genealogical tree
 
 	// first generation
-	Man *js = new Man("Smith", "James", nullptr, nullptr, nullptr);
-	Woman *ms = new Woman({}, "Mary", nullptr, nullptr, nullptr);
-	ms->setSpouse(js); js->setSpouse(ms);
+	Man *js = new Man("Smith", "James", nullptr, nullptr);
+	Woman *ms = new Woman("Mary", nullptr, nullptr);
 
 	// second generation
-	Woman *ps = new Woman({}, "Patricia", nullptr, js, ms);
-	Man *wj = new Man("Johnson", "William", nullptr, nullptr, nullptr);
-	ps->setSpouse(wj); wj->setSpouse(ps);
-
-	vector<Person *> marysKids = { ps,
-		new Man("Smith", "Robert", nullptr, js, ms),
-		new Woman({}, "Linda", nullptr, js, ms) };
-	ms->setChildren(marysKids);
+	Woman *ps = new Woman("Patricia", js, ms);
+	Man *wj = new Man("Johnson", "William", nullptr, nullptr);
+	Man *rs = new Man("Smith", "Robert", js, ms);
+	Woman *ls = new Woman("Linda", js, ms);
 
 	// third generation
-	Man *mj = new Man("Johnson", "Michael", nullptr, wj, ps);
-	vector<Person *> patsKids = { mj,
-		new Woman({}, "Barbara", nullptr, wj, ps) };
-	ps->setChildren(patsKids);
+	Man *mj = new Man("Johnson", "Michael", wj, ps);
+	Woman *bj = new Woman("Barbara", wj, ps);
+	Woman *jj = new Woman("Jennifer", nullptr, nullptr);
+	Woman *sj = new Woman("Susan", mj, jj);
 
-	Woman *jj = new Woman({}, "Jennifer", nullptr, nullptr, nullptr);
-	vector<Person *> jensKids = { new Woman({}, "Susan", nullptr, mj ,jj) };
-
-	jj->setSpouse(mj); mj->setSpouse(jj);
-	jj->setChildren(jensKids);
 
+	// births and marriages are recorded in date order. the history links
+	// spouses and children, and keeps every earlier version, so that
+	// eligibility can be asked for any day in the past
+	GenealogyHistory history;
+	history.recordBirth(js, 19280304);
+	history.recordBirth(ms, 19300611);
+	history.recordBirth(wj, 19490822);
+	history.recordMarriage(js, ms, 19520614);
+	history.recordBirth(ps, 19530402);
+	history.recordBirth(rs, 19550911);
+	history.recordBirth(ls, 19580120);
+	history.recordMarriage(ps, wj, 19740817);
+	history.recordBirth(mj, 19760304);
+	history.recordBirth(jj, 19770915);
+	history.recordBirth(bj, 19790722);
+	history.recordMarriage(mj, jj, 20000520);
+	history.recordBirth(sj, 20020213);
 
 	// defining two visitors
 	ChildrenPrinter *cp = new ChildrenPrinter;
 	NamePrinter *np = new NamePrinter;
 
+	// indexing everyone so that names can be looked up as they are typed
+	PersonDirectory directory(ms);
+	NameIndex nameIndex(directory);
+
 	string marriageCandidateOne; string marriageCandidateTwo;
 
 	cout << "Enter one marriage candidate:  ";
@@ -743,8 +1850,59 @@ int main() {
 	cout << "Enter another marriage candidate:  ";
 	std::getline(cin, marriageCandidateTwo);
 
-	MarriageAdvisor *ma = new MarriageAdvisor(marriageCandidateOne, marriageCandidateTwo);
+	Person *firstCandidate = resolveCandidate(nameIndex, directory, marriageCandidateOne);
+	Person *secondCandidate = resolveCandidate(nameIndex, directory, marriageCandidateTwo);
+	if (firstCandidate == nullptr || secondCandidate == nullptr)
+		return 0;
+
+	// the shards hold the tree as it is now, so no date is asked for
+	if (shardCount > 0) {
+#if defined(__unix__) || defined(__APPLE__)
+		TreeRecords records(directory);
+		MarriageAdvisor advisor(firstCandidate, secondCandidate, records);
+		ShardRouter router(shardCount, directory.people().size(), advisor.planner());
+		// a person is built from its parents, so ids come in parent first order
+		KinshipRecord record;
+		for (size_t id = 0; id < directory.people().size(); ++id)
+			if (records.fetch(static_cast<int32_t>(id), record))
+				router.add(static_cast<int32_t>(id), record);
+		router.finishLoading();
+		const bool allowed = router.canMarry({ { static_cast<int32_t>(firstCandidate->getId()),
+			static_cast<int32_t>(secondCandidate->getId()) } }).front();
+		cout << (allowed ? "They can marry!" : "They cannot marry!") << endl;
+#else
+		cout << "Sharding needs a POSIX system." << endl;
+#endif
+		return 0;
+	}
+
+	string marriageDate;
+	cout << "Enter a date as YYYYMMDD (blank for today):  ";
+	std::getline(cin, marriageDate);
+
+	long date = 0;
+	if (!marriageDate.empty() && !parseDate(marriageDate, date)) {
+		cout << "\"" << marriageDate << "\" is not a date of the form YYYYMMDD." << endl;
+		return 0;
+	}
+	const GenealogyVersion *version = marriageDate.empty() ? history.current() : history.asOf(date);
+	// nobody can marry before being born
+	if (version == nullptr || version->recordOf(firstCandidate) == nullptr
+		|| version->recordOf(secondCandidate) == nullptr) {
+		cout << "They cannot marry!" << endl;
+		return 0;
+	}
+
+	TreeRecords records(directory, version);
+	KinshipGraph kinshipGraph(directory);
+	MarriageAdvisor *ma = new MarriageAdvisor(firstCandidate, secondCandidate, records);
+	ma->explainWith(&kinshipGraph);
 
+	// the visitor walks the tree from its root and answers at the first
+	// candidate it meets. the composite only reaches descendants through
+	// their mothers, so a candidate it never meets (a husband, or a wife
+	// who married into the family) is visited directly
 	ms->accept(ma);
+	firstCandidate->accept(ma);
 }
 